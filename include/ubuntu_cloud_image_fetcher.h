@@ -8,12 +8,16 @@
 
 #include "nlohmann/json.hpp"
 #include "ubuntu_cloud_image_info.h"
+#include "ubuntu_cloud_image_history.h"
 
 
 enum class FetchError{
     NoError,
     FetchFailed,
-    JsonParseFailed
+    JsonParseFailed,
+    HistoryFailed,
+    InvalidTimestamp,
+    NotInHistory
 };
 
 enum class APIError{
@@ -36,10 +40,25 @@ private:
 
     JsonResult _fetchJson(const std::string& url); 
     FetchError _parseJson(const nlohmann::json& json);
+    FetchError _loadJson(const nlohmann::json& json);
+    JsonResult _fetchAndLoadJson(const std::string& url);
 
 public:
     FetchError FetchLatestImageInfo(const std::string& url);
 
+    // Same as above, and appends the fetched catalog to the history
+    // FetchError::HistoryFailed means only the recording failed, the fetched data is still usable
+    FetchError FetchLatestImageInfo(const std::string& url, UbuntuCloudImageHistory& history);
+
+    // Loads the catalog that was current at the given timestamp from the history, instead of fetching
+    // All the getters below then answer as of that timestamp
+    // Possible errors :
+    //  FetchError::InvalidTimestamp
+    //  FetchError::NotInHistory
+    //  FetchError::HistoryFailed
+    //  FetchError::FetchFailed
+    FetchError LoadImageInfoAsOf(const UbuntuCloudImageHistory& history, const std::string& timestamp);
+
     // Returns the currently supported releases in the previously fetched sample
     // Possible errors : 
     //  APIError::NotFetched
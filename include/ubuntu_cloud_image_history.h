@@ -0,0 +1,101 @@
+#ifndef UBUNTU_CLOUD_IMAGE_HISTORY_H
+#define UBUNTU_CLOUD_IMAGE_HISTORY_H
+
+#include <cstdint>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <variant>
+#include <vector>
+
+#include "nlohmann/json.hpp"
+
+
+enum class HistoryError{
+    NoError,
+    OpenFailed,
+    WriteFailed,
+    ReadFailed,
+    InvalidTimestamp,
+    NotFound,
+    Locked
+};
+
+// One stored snapshot, as kept in the index file
+struct UbuntuCloudImageHistoryRecord{
+    int64_t updated;        // "updated" of the catalog, seconds since epoch (UTC)
+    uint64_t offset;        // position of the record in the data file
+    uint64_t length;        // size of the record in the data file
+    bool checkpoint;        // full catalog if true, JSON patch against the previous snapshot otherwise
+};
+
+
+using HistoryJsonResult = std::variant<nlohmann::json, HistoryError>;
+
+
+// Append-only store of every fetched catalog.
+// Snapshots are kept as JSON patches against the previous one, with a full catalog every
+// checkpoint_interval snapshots, so any snapshot is rebuilt from at most that many records.
+// The store is made of two files in its directory :
+//  catalog.history : the records, one compact JSON document per line
+//  catalog.index   : one "<updated> <offset> <length> <F|D>" line per record
+// A store has a single writer at a time : Append holds catalog.lock, a directory created next to
+// the files, and fails with HistoryError::Locked while another process holds it. A lock left
+// behind by a killed process has to be removed by hand. Reading never modifies the store.
+class UbuntuCloudImageHistory {
+private:
+    std::string _dir;
+    size_t _checkpoint_interval;
+    std::vector<UbuntuCloudImageHistoryRecord> _records;
+    // Size of the complete lines of the index, anything after is an interrupted append
+    uint64_t _index_size = 0;
+
+    // Latest snapshot, needed to compute the next patch
+    nlohmann::json _head;
+    bool _head_loaded = false;
+
+    std::string _dataPath() const;
+    std::string _indexPath() const;
+    std::string _lockPath() const;
+    HistoryError _loadIndex();
+    HistoryError _readRecord(std::ifstream& data, const UbuntuCloudImageHistoryRecord& record, nlohmann::json& out) const;
+    HistoryJsonResult _reconstruct(size_t index) const;
+
+public:
+    explicit UbuntuCloudImageHistory(const std::string& dir, size_t checkpoint_interval = 30);
+
+    // Loads the index, a missing directory is an empty store
+    // Possible errors :
+    //  HistoryError::OpenFailed
+    HistoryError Open();
+
+    // Appends the catalog, skipped if it is identical to or older than the latest snapshot
+    // (ex : a stale copy served by a CDN)
+    // Possible errors :
+    //  HistoryError::InvalidTimestamp  (the "updated" field can not be parsed)
+    //  HistoryError::Locked            (another process is appending)
+    //  HistoryError::ReadFailed
+    //  HistoryError::WriteFailed
+    HistoryError Append(const nlohmann::json& catalog);
+
+    // Returns the latest catalog whose "updated" is not after the given timestamp
+    // Possible errors :
+    //  HistoryError::InvalidTimestamp
+    //  HistoryError::NotFound
+    //  HistoryError::ReadFailed
+    HistoryJsonResult GetAsOf(const std::string& timestamp) const;
+
+    const std::vector<UbuntuCloudImageHistoryRecord>& GetRecords() const { return _records; }
+
+    // Parses a timestamp into seconds since epoch (UTC). Accepted formats :
+    //  "Tue, 15 Oct 2024 09:37:46 +0000"   (as in the catalog "updated" field)
+    //  "2024-10-15T09:37:46Z", "2024-10-15 09:37:46"
+    //  "2024-10-15"                        (end of that day)
+    static std::optional<int64_t> ParseTimestamp(const std::string& timestamp);
+
+    // Formats seconds since epoch as "2024-10-15T09:37:46Z"
+    static std::string FormatTimestamp(int64_t timestamp);
+
+};
+
+#endif // UBUNTU_CLOUD_IMAGE_HISTORY_H
@@ -0,0 +1,109 @@
+#ifndef UBUNTU_CLOUD_IMAGE_MIRROR_H
+#define UBUNTU_CLOUD_IMAGE_MIRROR_H
+
+#include <cstdint>
+#include <string>
+#include <variant>
+#include <vector>
+
+#include "ubuntu_cloud_image_fetcher.h"
+
+class MirrorBandwidthLimiter;
+class MirrorScheduler;
+
+enum class MirrorError{
+    NoError,
+    NotFetched,
+    InvalidBaseUrl,
+    InvalidOptions,
+    DirectoryCreateFailed
+};
+
+
+// A single file that has to exist in the mirror directory
+struct UbuntuCloudImageMirrorItem{
+    std::string release;
+    std::string serial;
+
+    std::string host;           // "<host>[:port]" the download starts on, redirects may move it elsewhere
+    std::string remote_path;    // path on the host, starting with '/'
+    std::string local_path;     // path inside the mirror directory
+    std::string sha256;
+    uint64_t size = 0;
+};
+
+// A supported release which can not be mirrored, with the reason
+struct UbuntuCloudImageMirrorSkippedRelease{
+    std::string release;
+    std::string reason;
+};
+
+struct UbuntuCloudImageMirrorPlan{
+    std::vector<UbuntuCloudImageMirrorItem> items;
+    std::vector<UbuntuCloudImageMirrorSkippedRelease> unavailable;
+};
+
+struct UbuntuCloudImageMirrorOptions{
+    // Number of downloads running at the same time over all hosts, at least 1
+    size_t max_concurrent_downloads = 4;
+    // Number of downloads running at the same time against a single host, at least 1
+    // Counted against the host actually serving the download, redirects included
+    size_t max_connections_per_host = 2;
+    // Total download rate in bytes per second over all downloads, 0 means unlimited
+    uint64_t max_bytes_per_second = 0;
+};
+
+struct UbuntuCloudImageMirrorReport{
+    size_t planned = 0;         // supported releases, unavailable ones included
+    size_t skipped = 0;
+    size_t downloaded = 0;
+    size_t failed = 0;
+    uint64_t bytes_downloaded = 0;             // of the successful downloads only
+    std::vector<std::string> failed_items;     // "<release or path> : <reason>"
+};
+
+
+using MirrorPlanResult = std::variant<UbuntuCloudImageMirrorPlan, MirrorError>;
+using MirrorResult = std::variant<UbuntuCloudImageMirrorReport, MirrorError>;
+
+
+class UbuntuCloudImageMirror {
+private:
+    const UbuntuCloudImageFetcher& _fetcher;
+    std::string _host;
+    std::string _base_path;
+
+    bool _isPresentAndVerified(const UbuntuCloudImageMirrorItem& item) const;
+    // Returns an empty string on success, the reason of the failure otherwise
+    // Gives back the host connection the scheduler handed out with the item
+    std::string _download(const UbuntuCloudImageMirrorItem& item, MirrorScheduler& scheduler, MirrorBandwidthLimiter& limiter, uint64_t& bytes_downloaded) const;
+
+public:
+    // base_url is the root the item paths of the catalog are relative to.
+    // (ex : https://cloud-images.ubuntu.com/releases/)
+    UbuntuCloudImageMirror(const UbuntuCloudImageFetcher& fetcher, const std::string& base_url);
+
+    // Derives the mirror root from a Simplestreams catalog URL by dropping the "streams/v1/..." part.
+    // (ex : https://cloud-images.ubuntu.com/releases/streams/v1/index.json -> https://cloud-images.ubuntu.com/releases/)
+    static std::string BaseUrlFromCatalogUrl(const std::string& catalog_url);
+
+    // Returns the disk1.img of the newest serial of every currently supported release, largest first
+    // Releases without a disk1.img, or with a path outside of dir, are listed as unavailable
+    // Possible errors :
+    //  MirrorError::NotFetched
+    //  MirrorError::InvalidBaseUrl
+    MirrorPlanResult Plan(const std::string& dir) const;
+
+    // Downloads every planned item which is not already present and verified in dir
+    // Items are downloaded largest first within the limits given in options
+    // Unavailable releases and failed downloads are counted in failed
+    // Possible errors :
+    //  MirrorError::NotFetched
+    //  MirrorError::InvalidBaseUrl
+    //  MirrorError::InvalidOptions
+    //  MirrorError::DirectoryCreateFailed
+    MirrorResult Mirror(const std::string& dir, const UbuntuCloudImageMirrorOptions& options) const;
+
+};
+
+#endif // UBUNTU_CLOUD_IMAGE_MIRROR_H
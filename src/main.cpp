@@ -1,7 +1,11 @@
+#include <algorithm>
+#include <cctype>
 #include <iostream>
+#include <stdexcept>
 #include <string>
 #include <vector>
 #include "ubuntu_cloud_image_fetcher.h"
+#include "ubuntu_cloud_image_mirror.h"
 
 void PrintHelp() {
     std::cout << "Ubuntu Cloud Image Fetcher CLI\n"
@@ -11,6 +15,14 @@ void PrintHelp() {
               << "  --current-lts          Show current LTS version\n"
               << "  --sha256-uri <path>    Get SHA256 by version path\n"
               << "  --sha256-pubname <name> Get SHA256 by publication name\n"
+              << "  --mirror <dir>         Download the latest disk1.img of every supported release into dir\n"
+              << "  --max-downloads <n>    Mirror: downloads running at the same time (default 4)\n"
+              << "  --max-per-host <n>     Mirror: downloads running at the same time per host (default 2)\n"
+              << "  --max-bandwidth <bps>  Mirror: total download rate in bytes/s (default unlimited)\n"
+              << "  --history <dir>        Record every fetched catalog in the history store in dir\n"
+              << "  --as-of <timestamp>    Answer from the history store as of timestamp instead of fetching\n"
+              << "                         (ex : 2024-10-15, 2024-10-15T09:37:46Z), needs --history\n"
+              << "  --history-stats        Show the storage used by each snapshot of the history store\n"
               << "  --url <url>            Custom Simplestreams URL\n"
               << "  --clean                Minimal output (machine-readable)\n";
 }
@@ -25,10 +37,15 @@ int main(int argc, char* argv[]) {
         ListReleases,
         CurrentLTS,
         Sha256Uri,
-        Sha256Pubname
+        Sha256Pubname,
+        Mirror,
+        HistoryStats
     } command = Command::None;
     
     std::string argument;
+    UbuntuCloudImageMirrorOptions mirror_options;
+    std::string history_dir;
+    std::string as_of;
     std::vector<std::string> args(argv, argv + argc);
 
     // Parse command line arguments
@@ -62,6 +79,58 @@ int main(int argc, char* argv[]) {
             command = Command::Sha256Pubname;
             argument = args[++i];
         }
+        else if (args[i] == "--mirror") {
+            if (i + 1 >= args.size()) {
+                std::cerr << "Error: Missing argument for --mirror\n";
+                return 1;
+            }
+            command = Command::Mirror;
+            argument = args[++i];
+        }
+        else if (args[i] == "--max-downloads" || args[i] == "--max-per-host" || args[i] == "--max-bandwidth") {
+            if (i + 1 >= args.size()) {
+                std::cerr << "Error: Missing argument for " << args[i] << "\n";
+                return 1;
+            }
+            // stoull accepts "-1" and wraps it around, so only plain digits are let through
+            const std::string& number = args[i + 1];
+            bool valid = !number.empty() && std::all_of(number.begin(), number.end(), [](char c) { return std::isdigit(static_cast<unsigned char>(c)) != 0; });
+            uint64_t value = 0;
+            if (valid) {
+                try {
+                    value = std::stoull(number);
+                } catch (const std::out_of_range&) {
+                    valid = false;
+                }
+            }
+            // Bandwidth 0 means unlimited, but a concurrency of 0 would never download anything
+            if (valid && value == 0 && args[i] != "--max-bandwidth") valid = false;
+            if (!valid) {
+                std::cerr << "Error: Invalid number for " << args[i] << "\n";
+                return 1;
+            }
+            if (args[i] == "--max-downloads") mirror_options.max_concurrent_downloads = value;
+            else if (args[i] == "--max-per-host") mirror_options.max_connections_per_host = value;
+            else mirror_options.max_bytes_per_second = value;
+            ++i;
+        }
+        else if (args[i] == "--history") {
+            if (i + 1 >= args.size()) {
+                std::cerr << "Error: Missing argument for --history\n";
+                return 1;
+            }
+            history_dir = args[++i];
+        }
+        else if (args[i] == "--as-of") {
+            if (i + 1 >= args.size()) {
+                std::cerr << "Error: Missing argument for --as-of\n";
+                return 1;
+            }
+            as_of = args[++i];
+        }
+        else if (args[i] == "--history-stats") {
+            command = Command::HistoryStats;
+        }
         else if (args[i] == "--url") {
             if (i + 1 >= args.size()) {
                 std::cerr << "Error: Missing argument for --url\n";
@@ -76,7 +145,10 @@ int main(int argc, char* argv[]) {
         }
     }
 
-    if (command == Command::None) {
+    // Fetching with --history alone only records the catalog
+    bool record_only = command == Command::None && !history_dir.empty() && as_of.empty();
+
+    if (command == Command::None && !record_only) {
         if (!clean_output) {
             std::cerr << "Error: No command specified\n";
             PrintHelp();
@@ -84,9 +156,55 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    // Fetch data
-    auto err = fetcher.FetchLatestImageInfo(url);
+    if ((!as_of.empty() || command == Command::HistoryStats) && history_dir.empty()) {
+        if (!clean_output) {
+            std::cerr << "Error: --as-of and --history-stats need --history <dir>\n";
+        }
+        return 1;
+    }
+
+    UbuntuCloudImageHistory history(history_dir);
+    if (!history_dir.empty() && history.Open() != HistoryError::NoError) {
+        if (!clean_output) {
+            std::cerr << "Error: Failed to open history in " << history_dir << "\n";
+        }
+        return 1;
+    }
+
+    if (command == Command::HistoryStats) {
+        const auto& records = history.GetRecords();
+        if (!clean_output) {
+            std::cout << "History of " << records.size() << " snapshots in " << history_dir << ":\n";
+        }
+        uint64_t total = 0;
+        for (const auto& record : records) {
+            total += record.length + 1;
+            if (clean_output) {
+                std::cout << UbuntuCloudImageHistory::FormatTimestamp(record.updated) << " " << (record.checkpoint ? "full" : "delta") << " "
+                          << record.length + 1 << " " << total << "\n";
+            } else {
+                std::cout << " - " << UbuntuCloudImageHistory::FormatTimestamp(record.updated) << " : " << (record.checkpoint ? "full " : "delta ")
+                          << record.length + 1 << " bytes, " << total << " bytes in total\n";
+            }
+        }
+        return 0;
+    }
+
+    // Fetch data, or load it from the history
+    FetchError err;
+    if (!as_of.empty()) err = fetcher.LoadImageInfoAsOf(history, as_of);
+    else if (!history_dir.empty()) err = fetcher.FetchLatestImageInfo(url, history);
+    else err = fetcher.FetchLatestImageInfo(url);
     
+    // Failing to record the catalog does not prevent answering from it
+    if(err == FetchError::HistoryFailed && as_of.empty()) {
+        if (!clean_output) {
+            std::cerr << "Warning: Failed to record the catalog in history in " << history_dir << "\n";
+        }
+        if (record_only) return 1;
+        err = FetchError::NoError;
+    }
+
     if(err != FetchError::NoError) {
         if (!clean_output) {
             std::cerr << "Error: ";
@@ -97,6 +215,15 @@ int main(int argc, char* argv[]) {
                 case FetchError::JsonParseFailed:
                     std::cerr << "Failed to parse JSON data\n";
                     break;
+                case FetchError::HistoryFailed:
+                    std::cerr << "Failed to access history in " << history_dir << "\n";
+                    break;
+                case FetchError::InvalidTimestamp:
+                    std::cerr << "Invalid timestamp format\n";
+                    break;
+                case FetchError::NotInHistory:
+                    std::cerr << "No catalog in history as of " << as_of << "\n";
+                    break;
                 default:
                     std::cerr << "Unknown error\n";
             }
@@ -104,6 +231,8 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    if (record_only) return 0;
+
     // Execute command
     switch(command) {
         case Command::ListReleases: {
@@ -230,6 +359,50 @@ int main(int argc, char* argv[]) {
             break;
         }
         
+        case Command::Mirror: {
+            UbuntuCloudImageMirror mirror(fetcher, UbuntuCloudImageMirror::BaseUrlFromCatalogUrl(url));
+            auto res = mirror.Mirror(argument, mirror_options);
+            if(std::holds_alternative<MirrorError>(res)) {
+                if (!clean_output) {
+                    auto error = std::get<MirrorError>(res);
+                    std::cerr << "Error: ";
+                    switch(error) {
+                        case MirrorError::NotFetched:
+                            std::cerr << "Data not fetched - try again\n";
+                            break;
+                        case MirrorError::InvalidBaseUrl:
+                            std::cerr << "Invalid mirror base URL\n";
+                            break;
+                        case MirrorError::InvalidOptions:
+                            std::cerr << "Download limits must be at least 1\n";
+                            break;
+                        case MirrorError::DirectoryCreateFailed:
+                            std::cerr << "Failed to create mirror directory\n";
+                            break;
+                        default:
+                            std::cerr << "Unknown error\n";
+                    }
+                }
+                return 1;
+            }
+
+            auto report = std::get<UbuntuCloudImageMirrorReport>(res);
+            if (clean_output) {
+                std::cout << report.planned << " " << report.skipped << " "
+                          << report.downloaded << " " << report.failed << "\n";
+            } else {
+                std::cout << "Mirror of " << report.planned << " images into " << argument << ":\n"
+                          << " - " << report.skipped << " already present\n"
+                          << " - " << report.downloaded << " downloaded (" << report.bytes_downloaded << " bytes)\n"
+                          << " - " << report.failed << " failed\n";
+                for(const auto& failed : report.failed_items) {
+                    std::cerr << "Error: Failed to mirror " << failed << "\n";
+                }
+            }
+            if (report.failed > 0) return 1;
+            break;
+        }
+
         default:
             if (!clean_output) {
                 std::cerr << "Error: Invalid command\n";
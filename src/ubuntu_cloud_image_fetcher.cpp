@@ -108,16 +108,13 @@ FetchError UbuntuCloudImageFetcher::_parseJson(const json& j) {
     return FetchError::NoError;
 }
 
-FetchError UbuntuCloudImageFetcher::FetchLatestImageInfo(const std::string& url) {
-    // Clearup the previous data
+FetchError UbuntuCloudImageFetcher::_loadJson(const json& j) {
+    // Clearup the previous data, the getters answer NotFetched until the parse succeeds
+    _fetched = false;
     _fetched_sample.Clear();
-    // Get the JSON data
-    auto json_data = _fetchJson(url);
-    // If there is an error, abort
-    if (!std::holds_alternative<json>(json_data)) return FetchError::FetchFailed;
 
     // Parse the JSON data
-    auto result = _parseJson(std::get<json>(json_data));
+    auto result = _parseJson(j);
 
     // If there is no error, update _fetched
     if ( result == FetchError::NoError ) _fetched = true;
@@ -125,6 +122,56 @@ FetchError UbuntuCloudImageFetcher::FetchLatestImageInfo(const std::string& url)
     return result;
 }
 
+JsonResult UbuntuCloudImageFetcher::_fetchAndLoadJson(const std::string& url) {
+    // A failed fetch must not leave the previous sample answering
+    _fetched = false;
+    // Get the JSON data
+    auto json_data = _fetchJson(url);
+    // If there is an error, abort
+    if (!std::holds_alternative<json>(json_data)) return FetchError::FetchFailed;
+
+    auto result = _loadJson(std::get<json>(json_data));
+    if ( result != FetchError::NoError ) return result;
+
+    return json_data;
+}
+
+FetchError UbuntuCloudImageFetcher::FetchLatestImageInfo(const std::string& url) {
+    auto json_data = _fetchAndLoadJson(url);
+    if (std::holds_alternative<FetchError>(json_data)) return std::get<FetchError>(json_data);
+
+    return FetchError::NoError;
+}
+
+FetchError UbuntuCloudImageFetcher::FetchLatestImageInfo(const std::string& url, UbuntuCloudImageHistory& history) {
+    // Only record catalogs we can actually read back
+    auto json_data = _fetchAndLoadJson(url);
+    if (std::holds_alternative<FetchError>(json_data)) return std::get<FetchError>(json_data);
+
+    if (history.Append(std::get<json>(json_data)) != HistoryError::NoError) return FetchError::HistoryFailed;
+
+    return FetchError::NoError;
+}
+
+FetchError UbuntuCloudImageFetcher::LoadImageInfoAsOf(const UbuntuCloudImageHistory& history, const std::string& timestamp) {
+    // A failed load must not leave the previous sample answering
+    _fetched = false;
+
+    auto json_data = history.GetAsOf(timestamp);
+    if (std::holds_alternative<HistoryError>(json_data)) {
+        switch (std::get<HistoryError>(json_data)) {
+            case HistoryError::InvalidTimestamp:
+                return FetchError::InvalidTimestamp;
+            case HistoryError::NotFound:
+                return FetchError::NotInHistory;
+            default:
+                return FetchError::HistoryFailed;
+        }
+    }
+
+    return _loadJson(std::get<json>(json_data));
+}
+
 
 std::variant<const std::vector<UbuntuCloudImageSimplestreamsProduct>, APIError> UbuntuCloudImageFetcher::GetCurrentlySupportedReleases() const{
     // if not fetched, no reason to do calculation
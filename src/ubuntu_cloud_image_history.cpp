@@ -0,0 +1,350 @@
+#include "ubuntu_cloud_image_history.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+using json = nlohmann::json;
+namespace fs = std::filesystem;
+
+
+namespace {
+
+// Days since 1970-01-01 of a proleptic Gregorian date, avoids timegm which is not portable
+int64_t _daysFromCivil(int64_t y, unsigned m, unsigned d) {
+    y -= m <= 2;
+    const int64_t era = (y >= 0 ? y : y - 399) / 400;
+    const unsigned yoe = static_cast<unsigned>(y - era * 400);
+    const unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + static_cast<int64_t>(doe) - 719468;
+}
+
+// Inverse of _daysFromCivil
+void _civilFromDays(int64_t z, int64_t& y, unsigned& m, unsigned& d) {
+    z += 719468;
+    const int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    const unsigned doe = static_cast<unsigned>(z - era * 146097);
+    const unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    const unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    const unsigned mp = (5 * doy + 2) / 153;
+    d = doy - (153 * mp + 2) / 5 + 1;
+    m = mp < 10 ? mp + 3 : mp - 9;
+    y = static_cast<int64_t>(yoe) + era * 400 + (m <= 2);
+}
+
+int _daysInMonth(int year, int month) {
+    static const int days[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    bool leap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+    return month == 2 && leap ? 29 : days[month - 1];
+}
+
+bool _isValidTime(int year, int month, int day, int hour, int minute, int second) {
+    return year >= 1970 && month >= 1 && month <= 12 && day >= 1 && day <= _daysInMonth(year, month) &&
+           hour >= 0 && hour <= 23 && minute >= 0 && minute <= 59 && second >= 0 && second <= 60;
+}
+
+// Creating a directory is atomic on every platform, so it doubles as a lock
+class HistoryLock {
+private:
+    std::string _path;
+    bool _owned = false;
+
+public:
+    explicit HistoryLock(const std::string& path) : _path(path) {
+        std::error_code ec;
+        _owned = fs::create_directory(_path, ec) && !ec;
+    }
+    ~HistoryLock() {
+        std::error_code ec;
+        if (_owned) fs::remove(_path, ec);
+    }
+    HistoryLock(const HistoryLock&) = delete;
+    HistoryLock& operator=(const HistoryLock&) = delete;
+
+    bool Owned() const { return _owned; }
+};
+
+int64_t _toEpoch(int year, int month, int day, int hour, int minute, int second) {
+    return _daysFromCivil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second;
+}
+
+}
+
+
+UbuntuCloudImageHistory::UbuntuCloudImageHistory(const std::string& dir, size_t checkpoint_interval)
+    : _dir(dir), _checkpoint_interval(std::max<size_t>(checkpoint_interval, 1)) {}
+
+
+std::string UbuntuCloudImageHistory::_dataPath() const {
+    return (fs::path(_dir) / "catalog.history").string();
+}
+
+std::string UbuntuCloudImageHistory::_indexPath() const {
+    return (fs::path(_dir) / "catalog.index").string();
+}
+
+std::string UbuntuCloudImageHistory::_lockPath() const {
+    return (fs::path(_dir) / "catalog.lock").string();
+}
+
+
+std::optional<int64_t> UbuntuCloudImageHistory::ParseTimestamp(const std::string& timestamp) {
+    int year = 0, month = 0, day = 0, hour = 0, minute = 0, second = 0;
+    int consumed = 0;
+
+    // RFC 2822, the format of the catalog "updated" field : "Tue, 15 Oct 2024 09:37:46 +0000"
+    char month_name[4] = {0};
+    char zone[6] = {0};
+    if (std::sscanf(timestamp.c_str(), "%*3s, %d %3s %d %d:%d:%d %5s%n",
+                    &day, month_name, &year, &hour, &minute, &second, zone, &consumed) == 7 &&
+        consumed == static_cast<int>(timestamp.size())) {
+        static const char* months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                       "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+        for (int i = 0; i < 12; i++) {
+            if (std::strcmp(month_name, months[i]) == 0) month = i + 1;
+        }
+        if (!_isValidTime(year, month, day, hour, minute, second)) return std::nullopt;
+
+        // Zone is "+HHMM" or "-HHMM"
+        if (std::strlen(zone) != 5 || (zone[0] != '+' && zone[0] != '-')) return std::nullopt;
+        for (int i = 1; i < 5; i++) {
+            if (std::isdigit(static_cast<unsigned char>(zone[i])) == false) return std::nullopt;
+        }
+        int offset = ((zone[1] - '0') * 10 + (zone[2] - '0')) * 3600 + ((zone[3] - '0') * 10 + (zone[4] - '0')) * 60;
+        if (zone[0] == '-') offset = -offset;
+
+        return _toEpoch(year, month, day, hour, minute, second) - offset;
+    }
+
+    // ISO 8601 date and time, always UTC : "2024-10-15T09:37:46Z" or "2024-10-15 09:37:46"
+    char separator = 0;
+    consumed = 0;
+    if (std::sscanf(timestamp.c_str(), "%4d-%2d-%2d%c%2d:%2d:%2d%n",
+                    &year, &month, &day, &separator, &hour, &minute, &second, &consumed) == 7 &&
+        (separator == 'T' || separator == ' ')) {
+        std::string rest = timestamp.substr(consumed);
+        if (!rest.empty() && rest != "Z") return std::nullopt;
+        if (!_isValidTime(year, month, day, hour, minute, second)) return std::nullopt;
+        return _toEpoch(year, month, day, hour, minute, second);
+    }
+
+    // ISO 8601 date only, covers the whole day : "2024-10-15"
+    consumed = 0;
+    if (std::sscanf(timestamp.c_str(), "%4d-%2d-%2d%n", &year, &month, &day, &consumed) == 3 &&
+        consumed == static_cast<int>(timestamp.size())) {
+        if (!_isValidTime(year, month, day, 0, 0, 0)) return std::nullopt;
+        return _toEpoch(year, month, day, 23, 59, 59);
+    }
+
+    return std::nullopt;
+}
+
+
+std::string UbuntuCloudImageHistory::FormatTimestamp(int64_t timestamp) {
+    int64_t days = timestamp / 86400;
+    int64_t seconds = timestamp % 86400;
+    if (seconds < 0) {
+        seconds += 86400;
+        days--;
+    }
+
+    int64_t year = 0;
+    unsigned month = 0, day = 0;
+    _civilFromDays(days, year, month, day);
+
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%04lld-%02u-%02uT%02d:%02d:%02dZ",
+                  static_cast<long long>(year), month, day,
+                  static_cast<int>(seconds / 3600), static_cast<int>(seconds / 60 % 60), static_cast<int>(seconds % 60));
+    return buffer;
+}
+
+
+HistoryError UbuntuCloudImageHistory::Open() {
+    _records.clear();
+    _index_size = 0;
+    _head_loaded = false;
+
+    // A new store, created by the first Append
+    std::error_code ec;
+    if (!fs::exists(_dir, ec)) return HistoryError::NoError;
+    if (!fs::is_directory(_dir, ec)) return HistoryError::OpenFailed;
+
+    return _loadIndex();
+}
+
+
+HistoryError UbuntuCloudImageHistory::_loadIndex() {
+    _records.clear();
+    _index_size = 0;
+
+    std::error_code ec;
+    if (!fs::exists(_indexPath(), ec)) return HistoryError::NoError;
+
+    uint64_t data_size = fs::exists(_dataPath(), ec) ? fs::file_size(_dataPath(), ec) : 0;
+    if (ec) return HistoryError::OpenFailed;
+
+    std::ifstream index(_indexPath());
+    if (!index) return HistoryError::OpenFailed;
+
+    std::string line;
+    while (std::getline(index, line)) {
+        // Only the last line can be incomplete, left behind by an interrupted append
+        if (index.eof()) break;
+
+        std::istringstream fields(line);
+        UbuntuCloudImageHistoryRecord record;
+        char kind = 0;
+        if (!(fields >> record.updated >> record.offset >> record.length >> kind) || (kind != 'F' && kind != 'D')) {
+            return HistoryError::OpenFailed;
+        }
+        record.checkpoint = kind == 'F';
+        // The index is written after the data, so a record past the data file is incomplete
+        if (record.offset + record.length > data_size) break;
+        if (_records.empty() && !record.checkpoint) return HistoryError::OpenFailed;
+        _records.push_back(record);
+        _index_size += line.size() + 1;
+    }
+
+    return HistoryError::NoError;
+}
+
+
+HistoryError UbuntuCloudImageHistory::_readRecord(std::ifstream& data, const UbuntuCloudImageHistoryRecord& record, json& out) const {
+    std::string payload(record.length, '\0');
+    data.seekg(static_cast<std::streamoff>(record.offset));
+    data.read(payload.data(), static_cast<std::streamsize>(record.length));
+    if (static_cast<uint64_t>(data.gcount()) != record.length) return HistoryError::ReadFailed;
+
+    try {
+        out = json::parse(payload);
+    } catch (const json::parse_error&) {
+        return HistoryError::ReadFailed;
+    }
+    return HistoryError::NoError;
+}
+
+
+HistoryJsonResult UbuntuCloudImageHistory::_reconstruct(size_t index) const {
+    // Start from the closest checkpoint, never further than _checkpoint_interval records back
+    size_t checkpoint = index;
+    while (!_records[checkpoint].checkpoint) checkpoint--;
+
+    // One stream for the whole rebuild
+    std::ifstream data(_dataPath(), std::ios::binary);
+    if (!data) return HistoryError::ReadFailed;
+
+    json snapshot;
+    auto err = _readRecord(data, _records[checkpoint], snapshot);
+    if (err != HistoryError::NoError) return err;
+
+    for (size_t i = checkpoint + 1; i <= index; i++) {
+        json patch;
+        err = _readRecord(data, _records[i], patch);
+        if (err != HistoryError::NoError) return err;
+        try {
+            // patch() would copy the whole catalog for every record
+            snapshot.patch_inplace(patch);
+        } catch (const json::exception&) {
+            return HistoryError::ReadFailed;
+        }
+    }
+    return snapshot;
+}
+
+
+HistoryError UbuntuCloudImageHistory::Append(const json& catalog) {
+    std::optional<int64_t> updated;
+    try {
+        updated = ParseTimestamp(catalog.at("updated").get<std::string>());
+    } catch (const json::exception&) {
+        return HistoryError::InvalidTimestamp;
+    }
+    if (!updated) return HistoryError::InvalidTimestamp;
+
+    std::error_code ec;
+    fs::create_directories(_dir, ec);
+    if (ec) return HistoryError::WriteFailed;
+
+    HistoryLock lock(_lockPath());
+    if (!lock.Owned()) return HistoryError::Locked;
+
+    // Another process may have appended since Open
+    size_t known_records = _records.size();
+    if (_loadIndex() != HistoryError::NoError) return HistoryError::ReadFailed;
+    if (_records.size() != known_records) _head_loaded = false;
+
+    // Drop the tail of an interrupted append so the new line starts clean
+    if (fs::exists(_indexPath(), ec) && fs::file_size(_indexPath(), ec) > _index_size) {
+        fs::resize_file(_indexPath(), _index_size, ec);
+        if (ec) return HistoryError::WriteFailed;
+    }
+
+    bool checkpoint = true;
+    if (!_records.empty()) {
+        if (!_head_loaded) {
+            auto head = _reconstruct(_records.size() - 1);
+            if (std::holds_alternative<HistoryError>(head)) return std::get<HistoryError>(head);
+            _head = std::get<json>(std::move(head));
+            _head_loaded = true;
+        }
+
+        // Nothing changed since the last fetch, or a stale copy of an older catalog
+        if (catalog == _head || *updated < _records.back().updated) return HistoryError::NoError;
+
+        size_t since_checkpoint = 0;
+        for (auto it = _records.rbegin(); !it->checkpoint; ++it) since_checkpoint++;
+        checkpoint = since_checkpoint + 1 >= _checkpoint_interval;
+    }
+
+    std::string payload = checkpoint ? catalog.dump() : json::diff(_head, catalog).dump();
+
+    UbuntuCloudImageHistoryRecord record;
+    record.updated = *updated;
+    record.length = payload.size();
+    record.checkpoint = checkpoint;
+
+    record.offset = fs::exists(_dataPath(), ec) ? fs::file_size(_dataPath(), ec) : 0;
+    if (ec) return HistoryError::WriteFailed;
+
+    // Data first, the record only becomes visible once its index line is written
+    {
+        std::ofstream data(_dataPath(), std::ios::binary | std::ios::app);
+        data << payload << '\n';
+        data.flush();
+        if (!data) return HistoryError::WriteFailed;
+    }
+    {
+        std::ofstream index(_indexPath(), std::ios::app);
+        index << record.updated << ' ' << record.offset << ' ' << record.length << ' '
+              << (record.checkpoint ? 'F' : 'D') << '\n';
+        index.flush();
+        if (!index) return HistoryError::WriteFailed;
+    }
+
+    _records.push_back(record);
+    _index_size = fs::file_size(_indexPath(), ec);
+    _head = catalog;
+    _head_loaded = true;
+    return HistoryError::NoError;
+}
+
+
+HistoryJsonResult UbuntuCloudImageHistory::GetAsOf(const std::string& timestamp) const {
+    auto as_of = ParseTimestamp(timestamp);
+    if (!as_of) return HistoryError::InvalidTimestamp;
+
+    // Records are in "updated" order, find the last one not after as_of
+    auto it = std::upper_bound(_records.begin(), _records.end(), *as_of,
+                               [](int64_t value, const UbuntuCloudImageHistoryRecord& record) {
+                                   return value < record.updated;
+                               });
+    if (it == _records.begin()) return HistoryError::NotFound;
+
+    return _reconstruct(static_cast<size_t>(it - _records.begin()) - 1);
+}
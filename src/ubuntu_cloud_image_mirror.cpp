@@ -0,0 +1,456 @@
+#include "ubuntu_cloud_image_mirror.h"
+#include "httplib.h"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+
+namespace {
+
+// Minimal streaming SHA256, used to verify the downloaded images against the catalog
+class Sha256 {
+private:
+    static constexpr std::array<uint32_t, 64> _k = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+
+    std::array<uint32_t, 8> _state = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    std::array<uint8_t, 64> _block{};
+    size_t _block_len = 0;
+    uint64_t _total_len = 0;
+
+    static uint32_t _rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void _transform(const uint8_t* data) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t(data[i * 4]) << 24) | (uint32_t(data[i * 4 + 1]) << 16) |
+                   (uint32_t(data[i * 4 + 2]) << 8) | uint32_t(data[i * 4 + 3]);
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = _rotr(w[i - 15], 7) ^ _rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = _rotr(w[i - 2], 17) ^ _rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = _state[0], b = _state[1], c = _state[2], d = _state[3];
+        uint32_t e = _state[4], f = _state[5], g = _state[6], h = _state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t s1 = _rotr(e, 6) ^ _rotr(e, 11) ^ _rotr(e, 25);
+            uint32_t ch = (e & f) ^ (~e & g);
+            uint32_t t1 = h + s1 + ch + _k[i] + w[i];
+            uint32_t s0 = _rotr(a, 2) ^ _rotr(a, 13) ^ _rotr(a, 22);
+            uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t t2 = s0 + maj;
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        _state[0] += a; _state[1] += b; _state[2] += c; _state[3] += d;
+        _state[4] += e; _state[5] += f; _state[6] += g; _state[7] += h;
+    }
+
+public:
+    void Update(const char* data, size_t len) {
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+        _total_len += len;
+
+        // Fill up a partial block first
+        if (_block_len > 0) {
+            size_t take = std::min(len, _block.size() - _block_len);
+            std::memcpy(_block.data() + _block_len, bytes, take);
+            _block_len += take;
+            bytes += take;
+            len -= take;
+            if (_block_len < _block.size()) return;
+            _transform(_block.data());
+            _block_len = 0;
+        }
+        // Then the full blocks straight from the input
+        while (len >= _block.size()) {
+            _transform(bytes);
+            bytes += _block.size();
+            len -= _block.size();
+        }
+        std::memcpy(_block.data(), bytes, len);
+        _block_len = len;
+    }
+
+    // Returns the lowercase hex digest, the object should not be updated afterwards
+    std::string Final() {
+        uint64_t bit_len = _total_len * 8;
+        char pad = char(0x80);
+        Update(&pad, 1);
+        char zero = 0;
+        while (_block_len != 56) Update(&zero, 1);
+        char len_bytes[8];
+        for (int i = 0; i < 8; i++) len_bytes[i] = char(bit_len >> (56 - i * 8));
+        Update(len_bytes, 8);
+
+        static const char* hex = "0123456789abcdef";
+        std::string digest;
+        for (uint32_t word : _state) {
+            for (int shift = 28; shift >= 0; shift -= 4) digest.push_back(hex[(word >> shift) & 0xf]);
+        }
+        return digest;
+    }
+};
+
+constexpr std::array<uint32_t, 64> Sha256::_k;
+
+
+// Catalog paths are written below the mirror directory, so they must stay inside it
+bool _isSafeRelativePath(const std::string& path) {
+    if (path.empty() || path.front() == '/' || path.find('\\') != std::string::npos) return false;
+    for (const auto& part : fs::path(path)) {
+        if (part == "..") return false;
+    }
+    return true;
+}
+
+}
+
+
+// Shared between all the downloads so that the ceiling holds for the sum of them
+class MirrorBandwidthLimiter {
+private:
+    std::mutex _mutex;
+    uint64_t _bytes_per_second;
+    std::chrono::steady_clock::time_point _next_free;
+
+public:
+    explicit MirrorBandwidthLimiter(uint64_t bytes_per_second)
+        : _bytes_per_second(bytes_per_second), _next_free(std::chrono::steady_clock::now()) {}
+
+    // Blocks the caller until the given amount of bytes fits under the ceiling
+    void Consume(size_t bytes) {
+        if (_bytes_per_second == 0) return;
+
+        std::chrono::steady_clock::time_point wait_until;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto now = std::chrono::steady_clock::now();
+            // Idle time is not saved up for a later burst
+            if (_next_free < now) _next_free = now;
+            _next_free += std::chrono::nanoseconds(bytes * 1000000000ull / _bytes_per_second);
+            wait_until = _next_free;
+        }
+        std::this_thread::sleep_until(wait_until);
+    }
+};
+
+
+// Hands out the pending items largest first, within the per-host connection cap
+class MirrorScheduler {
+private:
+    std::mutex _mutex;
+    std::condition_variable _host_freed;
+    std::vector<UbuntuCloudImageMirrorItem> _pending;
+    std::map<std::string, size_t> _active_per_host;
+    size_t _max_per_host;
+
+public:
+    MirrorScheduler(std::vector<UbuntuCloudImageMirrorItem> pending, size_t max_per_host)
+        : _pending(std::move(pending)), _max_per_host(max_per_host) {}
+
+    // Blocks until an item can start, and takes a connection on its host for it
+    // Returns false once there is nothing left to download
+    bool Next(UbuntuCloudImageMirrorItem& item) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true) {
+            if (_pending.empty()) return false;
+            // Largest item whose host still has a free connection
+            auto it = std::find_if(_pending.begin(), _pending.end(), [&](const UbuntuCloudImageMirrorItem& candidate) {
+                return _active_per_host[candidate.host] < _max_per_host;
+            });
+            if (it != _pending.end()) {
+                item = *it;
+                _pending.erase(it);
+                _active_per_host[item.host]++;
+                return true;
+            }
+            _host_freed.wait(lock);
+        }
+    }
+
+    // Moves a running download to another host after a redirect, blocks until that host has a free connection
+    void SwitchHost(const std::string& from, const std::string& to) {
+        if (from == to) return;
+        std::unique_lock<std::mutex> lock(_mutex);
+        // Give the old connection back first, so two downloads redirected at each other can not deadlock
+        _active_per_host[from]--;
+        _host_freed.notify_all();
+        _host_freed.wait(lock, [&]() { return _active_per_host[to] < _max_per_host; });
+        _active_per_host[to]++;
+    }
+
+    void Done(const std::string& host) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _active_per_host[host]--;
+        }
+        _host_freed.notify_all();
+    }
+};
+
+
+UbuntuCloudImageMirror::UbuntuCloudImageMirror(const UbuntuCloudImageFetcher& fetcher, const std::string& base_url)
+    : _fetcher(fetcher) {
+    // Parse the URL into host and path, like the fetcher does
+    size_t host_start = base_url.find("://");
+    if (host_start == std::string::npos) return;
+    host_start += 3; // Skip "://"
+    size_t path_start = base_url.find('/', host_start);
+    if (path_start == std::string::npos) {
+        _host = base_url.substr(host_start);
+        _base_path = "/";
+    } else {
+        _host = base_url.substr(host_start, path_start - host_start);
+        _base_path = base_url.substr(path_start);
+    }
+    if (_base_path.back() != '/') _base_path.push_back('/');
+}
+
+
+std::string UbuntuCloudImageMirror::BaseUrlFromCatalogUrl(const std::string& catalog_url) {
+    size_t streams_pos = catalog_url.find("streams/v1/");
+    if (streams_pos != std::string::npos) return catalog_url.substr(0, streams_pos);
+
+    // Not a standard layout, assume the paths are relative to the catalog itself
+    size_t last_slash = catalog_url.rfind('/');
+    size_t host_start = catalog_url.find("://");
+    if (last_slash == std::string::npos || host_start == std::string::npos || last_slash < host_start + 3) {
+        return catalog_url + "/";
+    }
+    return catalog_url.substr(0, last_slash + 1);
+}
+
+
+MirrorPlanResult UbuntuCloudImageMirror::Plan(const std::string& dir) const {
+    if (_host.empty()) return MirrorError::InvalidBaseUrl;
+
+    auto supported_releases_err = _fetcher.GetCurrentlySupportedReleases();
+    if (std::holds_alternative<APIError>(supported_releases_err)) return MirrorError::NotFetched;
+
+    const auto& supported_releases = std::get<const std::vector<UbuntuCloudImageSimplestreamsProduct>>(supported_releases_err);
+
+    UbuntuCloudImageMirrorPlan plan;
+    for (const auto& release : supported_releases) {
+        // Find the newest serial which has a disk1.img
+        const UbuntuCloudImageSimplestreamsProductVersion* latest = nullptr;
+        const UbuntuCloudImageSimplestreamsProductVersionItem* latest_item = nullptr;
+        for (const auto& subversion : release.versions) {
+            // Serials are "YYYYMMDD[.N]" so they sort as strings
+            if (latest != nullptr && subversion.json_name <= latest->json_name) continue;
+            for (const auto& item : subversion.items) {
+                if (item.json_name == "disk1.img") {
+                    latest = &subversion;
+                    latest_item = &item;
+                    break;
+                }
+            }
+        }
+        if (latest_item == nullptr) {
+            plan.unavailable.push_back({release.release, "no disk1.img in any serial"});
+            continue;
+        }
+        if (_isSafeRelativePath(latest_item->path) == false) {
+            plan.unavailable.push_back({release.release, "unsafe path " + latest_item->path});
+            continue;
+        }
+
+        UbuntuCloudImageMirrorItem mirror_item;
+        mirror_item.release = release.release;
+        mirror_item.serial = latest->json_name;
+        mirror_item.host = _host;
+        mirror_item.remote_path = _base_path + latest_item->path;
+        mirror_item.local_path = (fs::path(dir) / latest_item->path).string();
+        mirror_item.sha256 = latest_item->sha256;
+        mirror_item.size = latest_item->size;
+        plan.items.push_back(mirror_item);
+    }
+
+    // Largest first, so the long downloads do not end up as the tail of the run
+    std::sort(plan.items.begin(), plan.items.end(), [](const UbuntuCloudImageMirrorItem& a, const UbuntuCloudImageMirrorItem& b) {
+        if (a.size != b.size) return a.size > b.size;
+        return a.local_path < b.local_path;
+    });
+
+    return plan;
+}
+
+
+bool UbuntuCloudImageMirror::_isPresentAndVerified(const UbuntuCloudImageMirrorItem& item) const {
+    std::error_code ec;
+    if (!fs::is_regular_file(item.local_path, ec)) return false;
+    // Cheap check first, hashing a full image takes a while
+    if (fs::file_size(item.local_path, ec) != item.size || ec) return false;
+
+    std::ifstream file(item.local_path, std::ios::binary);
+    if (!file) return false;
+
+    Sha256 hasher;
+    std::vector<char> buffer(1 << 16);
+    while (file) {
+        file.read(buffer.data(), buffer.size());
+        hasher.Update(buffer.data(), static_cast<size_t>(file.gcount()));
+    }
+    return hasher.Final() == item.sha256;
+}
+
+
+std::string UbuntuCloudImageMirror::_download(const UbuntuCloudImageMirrorItem& item, MirrorScheduler& scheduler, MirrorBandwidthLimiter& limiter, uint64_t& bytes_downloaded) const {
+    bytes_downloaded = 0;
+    std::string host = item.host;
+    std::string path = item.remote_path;
+
+    std::error_code ec;
+    fs::create_directories(fs::path(item.local_path).parent_path(), ec);
+    if (ec) {
+        scheduler.Done(host);
+        return "can not create directory";
+    }
+
+    // Download next to the target and only move it in place once verified
+    std::string part_path = item.local_path + ".part";
+    std::string reason;
+
+    // Redirects are followed here rather than by httplib, so the connection is counted on the right host
+    for (int redirects = 0; ; redirects++) {
+        std::ofstream file(part_path, std::ios::binary | std::ios::trunc);
+        if (!file) {
+            reason = "can not write " + part_path;
+            break;
+        }
+
+        Sha256 hasher;
+        bytes_downloaded = 0;
+        httplib::Client cli(host.c_str());
+
+        auto res = cli.Get(path.c_str(), [&](const char* data, size_t len) {
+            file.write(data, len);
+            hasher.Update(data, len);
+            bytes_downloaded += len;
+            limiter.Consume(len);
+            // Abort early on a write error or on a body larger than the catalog says
+            return file.good() && bytes_downloaded <= item.size;
+        });
+        file.close();
+
+        if (res && res->status >= 300 && res->status < 400 && res->has_header("Location")) {
+            // Absolute "http://host[:port]/path" or relative "/path"
+            std::string location = res->get_header_value("Location");
+            if (location.rfind("http://", 0) == 0) {
+                size_t path_start = location.find('/', 7);
+                std::string new_host = location.substr(7, path_start == std::string::npos ? std::string::npos : path_start - 7);
+                path = path_start == std::string::npos ? "/" : location.substr(path_start);
+                scheduler.SwitchHost(host, new_host);
+                host = new_host;
+            } else if (!location.empty() && location.front() == '/') {
+                path = location;
+            } else {
+                reason = "unsupported redirect to " + location;
+                break;
+            }
+            if (redirects == 5) {
+                reason = "too many redirects";
+                break;
+            }
+            continue;
+        }
+
+        // A body larger than the catalog size cancels the request, report it as such
+        if (bytes_downloaded > item.size) reason = "size mismatch";
+        else if (!res) reason = "request failed";
+        else if (res->status != 200) reason = "HTTP " + std::to_string(res->status);
+        else if (file.fail()) reason = "can not write " + part_path;
+        else if (bytes_downloaded != item.size) reason = "size mismatch";
+        else if (hasher.Final() != item.sha256) reason = "SHA256 mismatch";
+        else {
+            fs::rename(part_path, item.local_path, ec);
+            if (ec) reason = "can not move " + part_path + " in place";
+        }
+        break;
+    }
+
+    scheduler.Done(host);
+    if (!reason.empty()) fs::remove(part_path, ec);
+    return reason;
+}
+
+
+MirrorResult UbuntuCloudImageMirror::Mirror(const std::string& dir, const UbuntuCloudImageMirrorOptions& options) const {
+    if (options.max_concurrent_downloads == 0 || options.max_connections_per_host == 0) return MirrorError::InvalidOptions;
+
+    auto plan_err = Plan(dir);
+    if (std::holds_alternative<MirrorError>(plan_err)) return std::get<MirrorError>(plan_err);
+
+    const auto& plan = std::get<UbuntuCloudImageMirrorPlan>(plan_err);
+
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    if (ec || !fs::is_directory(dir, ec)) return MirrorError::DirectoryCreateFailed;
+
+    UbuntuCloudImageMirrorReport report;
+    report.planned = plan.items.size() + plan.unavailable.size();
+    for (const auto& unavailable : plan.unavailable) {
+        report.failed++;
+        report.failed_items.push_back(unavailable.release + " : " + unavailable.reason);
+    }
+
+    // The plan is already largest first, keep that order for the queue
+    std::vector<UbuntuCloudImageMirrorItem> pending;
+    for (const auto& item : plan.items) {
+        if (_isPresentAndVerified(item)) report.skipped++;
+        else pending.push_back(item);
+    }
+    if (pending.empty()) return report;
+
+    size_t worker_count = std::min(options.max_concurrent_downloads, pending.size());
+    MirrorScheduler scheduler(std::move(pending), options.max_connections_per_host);
+    MirrorBandwidthLimiter limiter(options.max_bytes_per_second);
+    std::mutex report_mutex;
+
+    auto worker = [&]() {
+        UbuntuCloudImageMirrorItem item;
+        while (scheduler.Next(item)) {
+            uint64_t bytes_downloaded = 0;
+            std::string reason = _download(item, scheduler, limiter, bytes_downloaded);
+
+            std::lock_guard<std::mutex> lock(report_mutex);
+            if (reason.empty()) {
+                report.downloaded++;
+                report.bytes_downloaded += bytes_downloaded;
+            } else {
+                report.failed++;
+                report.failed_items.push_back(item.local_path + " : " + reason);
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < worker_count; i++) {
+        workers.emplace_back(worker);
+    }
+    for (auto& t : workers) t.join();
+
+    return report;
+}
@@ -0,0 +1,17 @@
+#ifndef TESTS_CHECK_H
+#define TESTS_CHECK_H
+
+#include <iostream>
+
+// Number of failed checks, the test returns 1 if it is not 0 at the end
+static int failures = 0;
+
+#define CHECK(condition)                                                            \
+    do {                                                                            \
+        if (!(condition)) {                                                         \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK failed: " #condition "\n"; \
+            failures++;                                                             \
+        }                                                                           \
+    } while (0)
+
+#endif // TESTS_CHECK_H
@@ -0,0 +1,215 @@
+// Builds a synthetic year of daily catalog fetches into a UbuntuCloudImageHistory, checks that
+// the days are rebuilt exactly, and prints the storage used by each snapshot.
+#include "ubuntu_cloud_image_fetcher.h"
+#include "ubuntu_cloud_image_history.h"
+#include "check.h"
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+using json = nlohmann::json;
+namespace fs = std::filesystem;
+
+
+static const int64_t first_day = 1704067200;   // 2024-01-01T00:00:00Z
+static const int days_in_year = 366;
+
+// "Mon, 01 Jan 2024 09:00:00 +0000", the format of the catalog "updated" field
+static std::string RfcTimestamp(int64_t timestamp) {
+    static const char* weekdays[] = {"Thu", "Fri", "Sat", "Sun", "Mon", "Tue", "Wed"};
+    static const char* months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                   "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    // "2024-01-01T09:00:00Z"
+    std::string iso = UbuntuCloudImageHistory::FormatTimestamp(timestamp);
+    return std::string(weekdays[(timestamp / 86400) % 7]) + ", " + iso.substr(8, 2) + " " +
+           months[std::stoi(iso.substr(5, 2)) - 1] + " " + iso.substr(0, 4) + " " + iso.substr(11, 8) + " +0000";
+}
+
+// "20240101"
+static std::string Serial(int64_t timestamp) {
+    std::string iso = UbuntuCloudImageHistory::FormatTimestamp(timestamp);
+    return iso.substr(0, 4) + iso.substr(5, 2) + iso.substr(8, 2);
+}
+
+// Day "day" of the synthetic year : every release gets a new serial every 5 days, the oldest
+// serials are dropped past 20, a release appears in spring and another one leaves support in summer
+static void AdvanceCatalog(json& catalog, int day) {
+    struct Release { const char* version; const char* codename; const char* title; int first_day; int eol_day; };
+    static const Release releases[] = {
+        {"18.04", "bionic", "18.04 LTS", -1000, 1000},
+        {"20.04", "focal", "20.04 LTS", -1000, 1000},
+        {"22.04", "jammy", "22.04 LTS", -1000, 1000},
+        {"23.10", "mantic", "23.10", -1000, 192},
+        {"24.04", "noble", "24.04 LTS", 115, 1000},
+        {"24.10", "oracular", "24.10", 283, 1000},
+    };
+    int64_t timestamp = first_day + static_cast<int64_t>(day) * 86400;
+
+    for (int r = 0; r < 6; r++) {
+        const auto& release = releases[r];
+        if (day < release.first_day) continue;
+
+        auto& product = catalog["products"][std::string("com.ubuntu.cloud:server:") + release.version + ":amd64"];
+        if (product.is_null()) {
+            product["aliases"] = release.version;
+            product["arch"] = "amd64";
+            product["os"] = "ubuntu";
+            product["release"] = release.codename;
+            product["release_codename"] = release.codename;
+            product["release_title"] = release.title;
+            product["support_eol"] = "2030-01-01";
+            product["version"] = release.version;
+            product["versions"] = json::object();
+        }
+        product["supported"] = day < release.eol_day;
+
+        if (day < release.eol_day && (day + r * 3) % 5 == 0) {
+            std::string serial = Serial(timestamp);
+            auto& version = product["versions"][serial];
+            version["label"] = "release";
+            version["pubname"] = std::string("ubuntu-") + release.codename + "-" + release.version + "-amd64-server-" + serial;
+            for (const char* ftype : {"disk1.img", "tar.gz", "manifest", "squashfs"}) {
+                json item;
+                item["ftype"] = ftype;
+                item["md5"] = std::string(32, static_cast<char>('0' + day % 10));
+                item["path"] = std::string("server/releases/") + release.codename + "/release-" + serial + "/" + ftype;
+                item["sha256"] = std::string(64, static_cast<char>('a' + (day + r) % 6));
+                item["size"] = static_cast<uint64_t>(600000000 + day * 1000 + r);
+                version["items"][ftype] = item;
+            }
+            if (product["versions"].size() > 20) product["versions"].erase(product["versions"].begin());
+        }
+    }
+    catalog["updated"] = RfcTimestamp(timestamp + 9 * 3600);
+}
+
+
+int main() {
+    // Unique per run, so concurrent runs do not share the store
+    const fs::path dir = fs::temp_directory_path() / ("ubuntu_cloud_image_history_test_" + std::to_string(std::random_device{}()));
+    fs::remove_all(dir);
+
+    json catalog;
+    catalog["content_id"] = "com.ubuntu.cloud:released:download";
+    catalog["creator"] = "history_test";
+    catalog["datatype"] = "image-downloads";
+    catalog["format"] = "products:1.0";
+    catalog["license"] = "test";
+
+    // Two months of history exist before the store starts
+    for (int day = -60; day < 0; day++) AdvanceCatalog(catalog, day);
+
+    // A year of daily fetches
+    std::vector<json> fetched;
+    uint64_t full_copies_size = 0;
+    {
+        UbuntuCloudImageHistory history(dir.string());
+        CHECK(history.Open() == HistoryError::NoError);
+        for (int day = 0; day < days_in_year; day++) {
+            AdvanceCatalog(catalog, day);
+            CHECK(history.Append(catalog) == HistoryError::NoError);
+            fetched.push_back(catalog);
+            full_copies_size += catalog.dump().size() + 1;
+
+            // A stale copy of yesterday's catalog is not recorded
+            if (day > 0) CHECK(history.Append(fetched[day - 1]) == HistoryError::NoError);
+        }
+        CHECK(history.GetRecords().size() == days_in_year);
+    }
+
+    UbuntuCloudImageHistory history(dir.string());
+    CHECK(history.Open() == HistoryError::NoError);
+    const auto& records = history.GetRecords();
+    CHECK(records.size() == days_in_year);
+
+    // Every 7th day and the last one are rebuilt exactly, both by date and by the exact "updated" time
+    // The step moves through the checkpoint interval, so every distance from a checkpoint is covered
+    std::vector<int> checked_days;
+    for (int day = 0; day < days_in_year; day += 7) checked_days.push_back(day);
+    checked_days.push_back(days_in_year - 1);
+    auto start = std::chrono::steady_clock::now();
+    for (int day : checked_days) {
+        std::string date = UbuntuCloudImageHistory::FormatTimestamp(first_day + static_cast<int64_t>(day) * 86400).substr(0, 10);
+        auto snapshot = history.GetAsOf(date);
+        CHECK(std::holds_alternative<json>(snapshot) && std::get<json>(snapshot) == fetched[day]);
+    }
+    double query_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / checked_days.size();
+    {
+        auto snapshot = history.GetAsOf(fetched[100]["updated"].get<std::string>());
+        CHECK(std::holds_alternative<json>(snapshot) && std::get<json>(snapshot) == fetched[100]);
+    }
+
+    // Before the first fetch, and invalid dates
+    {
+        auto snapshot = history.GetAsOf("2023-12-31");
+        CHECK(std::holds_alternative<HistoryError>(snapshot) && std::get<HistoryError>(snapshot) == HistoryError::NotFound);
+        snapshot = history.GetAsOf("2024-02-31");
+        CHECK(std::holds_alternative<HistoryError>(snapshot) && std::get<HistoryError>(snapshot) == HistoryError::InvalidTimestamp);
+        snapshot = history.GetAsOf("2023-02-29");
+        CHECK(std::holds_alternative<HistoryError>(snapshot) && std::get<HistoryError>(snapshot) == HistoryError::InvalidTimestamp);
+        CHECK(std::holds_alternative<json>(history.GetAsOf("2024-02-29")));
+    }
+
+    // The getters answer as of the date
+    {
+        UbuntuCloudImageFetcher fetcher;
+        CHECK(fetcher.LoadImageInfoAsOf(history, "2024-03-01") == FetchError::NoError);
+        auto lts = fetcher.GetCurrentLTSVersion();
+        CHECK(std::holds_alternative<const UbuntuCloudImageSimplestreamsProduct>(lts) &&
+              std::get<const UbuntuCloudImageSimplestreamsProduct>(lts).version == "22.04");
+
+        CHECK(fetcher.LoadImageInfoAsOf(history, "2024-06-01") == FetchError::NoError);
+        auto lts_later = fetcher.GetCurrentLTSVersion();
+        CHECK(std::holds_alternative<const UbuntuCloudImageSimplestreamsProduct>(lts_later) &&
+              std::get<const UbuntuCloudImageSimplestreamsProduct>(lts_later).version == "24.04");
+
+        CHECK(fetcher.LoadImageInfoAsOf(history, "2023-06-01") == FetchError::NotInHistory);
+        // The sample of the previous load does not keep answering
+        auto lts_failed = fetcher.GetCurrentLTSVersion();
+        CHECK(std::holds_alternative<APIError>(lts_failed) && std::get<APIError>(lts_failed) == APIError::NotFetched);
+    }
+
+    // Another process holding the lock prevents appending
+    {
+        fs::create_directory(dir / "catalog.lock");
+        UbuntuCloudImageHistory writer(dir.string());
+        CHECK(writer.Open() == HistoryError::NoError);
+        json next = catalog;
+        AdvanceCatalog(next, days_in_year);
+        CHECK(writer.Append(next) == HistoryError::Locked);
+        fs::remove(dir / "catalog.lock");
+    }
+
+    // Storage growth per snapshot
+    uint64_t total = 0, checkpoints = 0, deltas = 0;
+    size_t delta_count = 0;
+    std::cout << "snapshot             kind   bytes   total\n";
+    for (const auto& record : records) {
+        uint64_t size = record.length + 1;
+        total += size;
+        if (record.checkpoint) {
+            checkpoints += size;
+        } else {
+            deltas += size;
+            delta_count++;
+        }
+        std::cout << UbuntuCloudImageHistory::FormatTimestamp(record.updated) << " "
+                  << (record.checkpoint ? "full " : "delta") << " " << size << " " << total << "\n";
+    }
+    std::cout << records.size() << " snapshots : " << total << " bytes ("
+              << checkpoints << " in checkpoints, " << (delta_count ? deltas / delta_count : 0) << " per delta on average), "
+              << full_copies_size << " bytes as full copies, " << query_ms << " ms per as-of query\n";
+    CHECK(total < full_copies_size / 5);
+
+    fs::remove_all(dir);
+
+    if (failures > 0) {
+        std::cerr << failures << " check(s) failed\n";
+        return 1;
+    }
+    std::cout << "history_test passed\n";
+    return 0;
+}
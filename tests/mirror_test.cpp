@@ -0,0 +1,393 @@
+// End-to-end test of UbuntuCloudImageMirror against a local httplib::Server serving synthetic
+// catalogs and images, including the connection limits, order and rate limit of the scheduler.
+#include "ubuntu_cloud_image_fetcher.h"
+#include "ubuntu_cloud_image_mirror.h"
+#include "httplib.h"
+#include "check.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using json = nlohmann::json;
+namespace fs = std::filesystem;
+
+
+// SHA256 of the synthetic bodies, computed outside of the code under test
+static const std::string jammy_body(300000, 'a');
+static const std::string jammy_sha256 = "12e1b9b179b29a4f7e5889b185d7ac71bff0ad1f49a7b391d0911b737a0f5381";
+static const std::string noble_body(200000, 'b');
+static const std::string noble_sha256 = "31731ec46c3318e622490d1102d6a5f2d0b33995b35ede8cdbbb76252ee6d87b";
+static const std::string oracular_catalog_body(100000, 'c');
+static const std::string oracular_catalog_sha256 = "c280c4324f84f4884572910d1ca3e6f04b421c6928ee4aefc5bc270ee3307f69";
+static const uint64_t questing_catalog_size = 50000;
+
+// Images of the scheduler catalog, listed largest first. The redirected ones are served by
+// "localhost" under /elsewhere/, the others by "127.0.0.1" under /sched/
+struct SchedulerImage { const char* codename; char fill; uint64_t size; const char* sha256; bool redirected; };
+static const SchedulerImage scheduler_images[] = {
+    {"alpha", 'f', 400000, "20d39e1c5e55a248d191c26a64abba8b0ed9ba6a746cbfff96fb23861bb2b768", false},
+    {"bravo", 'g', 350000, "a6c03b72fbc7c33065ec413203b555e723a6cbf34e9ab5687a82fb660b9b0968", true},
+    {"charlie", 'h', 250000, "17ae645473975ef62287ce6443dfd444671f7b51f6adb7e154eb5e6498a29d15", false},
+    {"delta", 'i', 150000, "c0222bb70deefc4b065da619195e506b03c2385b0d5a4b42596b805b3d062fab", true},
+    {"echo", 'j', 100000, "3b2838a1d419b2c19a1eaae505404ec543c470f413253291e01cfeb46344734e", false},
+    {"foxtrot", 'k', 50000, "8e625b9d9d1a7944fd010d94ea6b374562fc8019024204a693c44cba989f2bc2", false},
+};
+static const uint64_t scheduler_total_size = 1300000;
+
+
+static json MakeItem(const std::string& ftype, const std::string& path, const std::string& sha256, uint64_t size) {
+    json item;
+    item["ftype"] = ftype;
+    item["md5"] = "";
+    item["path"] = path;
+    item["sha256"] = sha256;
+    item["size"] = size;
+    return item;
+}
+
+static json MakeProduct(const std::string& version, const std::string& codename, const std::string& title, bool supported) {
+    json product;
+    product["aliases"] = version;
+    product["arch"] = "amd64";
+    product["os"] = "ubuntu";
+    product["release"] = codename;
+    product["release_codename"] = codename;
+    product["release_title"] = title;
+    product["support_eol"] = "2030-01-01";
+    product["supported"] = supported;
+    product["version"] = version;
+    product["versions"] = json::object();
+    return product;
+}
+
+static void AddVersion(json& product, const std::string& serial, const std::string& item_name, const json& item) {
+    auto& version = product["versions"][serial];
+    version["label"] = "release";
+    version["pubname"] = "ubuntu-" + product["release"].get<std::string>() + "-" + product["version"].get<std::string>() + "-amd64-server-" + serial;
+    version["items"][item_name] = item;
+}
+
+static json MakeCatalog() {
+    json catalog;
+    catalog["content_id"] = "com.ubuntu.cloud:released:download";
+    catalog["creator"] = "mirror_test";
+    catalog["datatype"] = "image-downloads";
+    catalog["format"] = "products:1.0";
+    catalog["license"] = "test";
+    catalog["updated"] = "Tue, 15 Oct 2024 09:37:46 +0000";
+
+    // Two serials, only the newest one must be mirrored
+    auto jammy = MakeProduct("22.04", "jammy", "22.04 LTS", true);
+    AddVersion(jammy, "20240101", "disk1.img", MakeItem("disk1.img", "server/jammy/old/disk1.img", jammy_sha256, 1));
+    AddVersion(jammy, "20240301", "disk1.img", MakeItem("disk1.img", "server/jammy/20240301/disk1.img", jammy_sha256, jammy_body.size()));
+
+    // Served through a redirect to another host name
+    auto noble = MakeProduct("24.04", "noble", "24.04 LTS", true);
+    AddVersion(noble, "20240501", "disk1.img", MakeItem("disk1.img", "server/noble/20240501/disk1.img", noble_sha256, noble_body.size()));
+
+    // The server sends a body of the right size but with other content
+    auto oracular = MakeProduct("24.10", "oracular", "24.10", true);
+    AddVersion(oracular, "20241010", "disk1.img", MakeItem("disk1.img", "server/oracular/20241010/disk1.img", oracular_catalog_sha256, oracular_catalog_body.size()));
+
+    // The server sends more than the catalog size
+    auto questing = MakeProduct("25.10", "questing", "25.10", true);
+    AddVersion(questing, "20251010", "disk1.img", MakeItem("disk1.img", "server/questing/20251010/disk1.img", noble_sha256, questing_catalog_size));
+
+    // Nothing to mirror
+    auto plucky = MakeProduct("25.04", "plucky", "25.04", true);
+    AddVersion(plucky, "20250401", "root.tar.xz", MakeItem("root.tar.xz", "server/plucky/20250401/root.tar.xz", noble_sha256, 1));
+
+    // Not supported, must be ignored
+    auto focal = MakeProduct("20.04", "focal", "20.04 LTS", false);
+    AddVersion(focal, "20240101", "disk1.img", MakeItem("disk1.img", "server/focal/20240101/disk1.img", jammy_sha256, 1));
+
+    catalog["products"]["com.ubuntu.cloud:server:22.04:amd64"] = jammy;
+    catalog["products"]["com.ubuntu.cloud:server:24.04:amd64"] = noble;
+    catalog["products"]["com.ubuntu.cloud:server:24.10:amd64"] = oracular;
+    catalog["products"]["com.ubuntu.cloud:server:25.04:amd64"] = plucky;
+    catalog["products"]["com.ubuntu.cloud:server:25.10:amd64"] = questing;
+    catalog["products"]["com.ubuntu.cloud:server:20.04:amd64"] = focal;
+    return catalog;
+}
+
+// Catalog of scheduler_images, in a random release order so the plan has to sort them
+static json MakeSchedulerCatalog() {
+    json catalog = MakeCatalog();
+    catalog["products"] = json::object();
+    int version = 10;
+    for (const char* codename : {"delta", "alpha", "foxtrot", "charlie", "echo", "bravo"}) {
+        for (const auto& image : scheduler_images) {
+            if (std::string(image.codename) != codename) continue;
+            std::string version_str = std::to_string(version++) + ".04";
+            auto product = MakeProduct(version_str, image.codename, version_str, true);
+            AddVersion(product, "20240101", "disk1.img", MakeItem("disk1.img", std::string("images/") + image.codename + "/disk1.img", image.sha256, image.size));
+            catalog["products"]["com.ubuntu.cloud:server:" + version_str + ":amd64"] = product;
+        }
+    }
+    return catalog;
+}
+
+// Requests being served, per host and over all hosts, with the highest counts seen and the
+// order in which the images were first requested
+class ServerMonitor {
+private:
+    std::mutex _mutex;
+    std::map<std::string, int> _active;
+    int _active_total = 0;
+
+public:
+    std::map<std::string, int> peak;
+    int peak_total = 0;
+    std::vector<std::string> order;
+
+    void Enter(const std::string& host, const std::string& first_request_of) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!first_request_of.empty()) order.push_back(first_request_of);
+        peak[host] = std::max(peak[host], ++_active[host]);
+        peak_total = std::max(peak_total, ++_active_total);
+    }
+
+    void Leave(const std::string& host) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _active[host]--;
+        _active_total--;
+    }
+
+    void Reset() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        peak.clear();
+        peak_total = 0;
+        order.clear();
+    }
+};
+
+static std::string ReadFile(const fs::path& path) {
+    std::ifstream file(path, std::ios::binary);
+    std::stringstream content;
+    content << file.rdbuf();
+    return content.str();
+}
+
+static bool HasFailure(const UbuntuCloudImageMirrorReport& report, const std::string& needle) {
+    for (const auto& failed : report.failed_items) {
+        if (failed.find(needle) != std::string::npos) return true;
+    }
+    return false;
+}
+
+
+int main() {
+    const std::string catalog = MakeCatalog().dump();
+    std::map<std::string, std::atomic<int>> hits;
+    hits["jammy"] = 0;
+    hits["noble"] = 0;
+
+    httplib::Server svr;
+    int port = svr.bind_to_any_port("127.0.0.1");
+    if (port <= 0) {
+        std::cerr << "Can not bind a local port\n";
+        return 1;
+    }
+    const std::string port_str = std::to_string(port);
+
+    svr.Get("/releases/streams/v1/index.json", [&](const httplib::Request&, httplib::Response& res) {
+        res.set_content(catalog, "application/json");
+    });
+    svr.Get("/releases/server/jammy/20240301/disk1.img", [&](const httplib::Request&, httplib::Response& res) {
+        hits["jammy"]++;
+        res.set_content(jammy_body, "application/octet-stream");
+    });
+    svr.Get("/releases/server/noble/20240501/disk1.img", [&](const httplib::Request&, httplib::Response& res) {
+        res.set_redirect("http://localhost:" + port_str + "/elsewhere/noble.img");
+    });
+    svr.Get("/elsewhere/noble.img", [&](const httplib::Request&, httplib::Response& res) {
+        hits["noble"]++;
+        res.set_content(noble_body, "application/octet-stream");
+    });
+    svr.Get("/releases/server/oracular/20241010/disk1.img", [&](const httplib::Request&, httplib::Response& res) {
+        res.set_content(std::string(oracular_catalog_body.size(), 'd'), "application/octet-stream");
+    });
+    svr.Get("/releases/server/questing/20251010/disk1.img", [&](const httplib::Request&, httplib::Response& res) {
+        res.set_content(std::string(questing_catalog_size + 10000, 'e'), "application/octet-stream");
+    });
+
+
+    // Every request of the scheduler catalog is held long enough for the downloads to overlap
+    ServerMonitor monitor;
+    const std::string scheduler_catalog = MakeSchedulerCatalog().dump();
+    svr.Get("/sched/streams/v1/index.json", [&](const httplib::Request&, httplib::Response& res) {
+        res.set_content(scheduler_catalog, "application/json");
+    });
+    for (const auto& image : scheduler_images) {
+        const std::string codename = image.codename;
+        const std::string body(image.size, image.fill);
+        const bool redirected = image.redirected;
+        svr.Get("/sched/images/" + codename + "/disk1.img", [&monitor, &port_str, codename, body, redirected](const httplib::Request&, httplib::Response& res) {
+            monitor.Enter("127.0.0.1", codename);
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            if (redirected) res.set_redirect("http://localhost:" + port_str + "/elsewhere/" + codename + ".img");
+            else res.set_content(body, "application/octet-stream");
+            monitor.Leave("127.0.0.1");
+        });
+        if (redirected) {
+            svr.Get("/elsewhere/" + codename + ".img", [&monitor, body](const httplib::Request&, httplib::Response& res) {
+                monitor.Enter("localhost", "");
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                res.set_content(body, "application/octet-stream");
+                monitor.Leave("localhost");
+            });
+        }
+    }
+
+    std::thread server_thread([&]() { svr.listen_after_bind(); });
+    svr.wait_until_ready();
+
+    const std::string url = "http://127.0.0.1:" + port_str + "/releases/streams/v1/index.json";
+    const fs::path dir = fs::temp_directory_path() / ("ubuntu_cloud_image_mirror_test_" + port_str);
+    fs::remove_all(dir);
+
+    UbuntuCloudImageFetcher fetcher;
+    CHECK(fetcher.FetchLatestImageInfo(url) == FetchError::NoError);
+
+    UbuntuCloudImageMirror mirror(fetcher, UbuntuCloudImageMirror::BaseUrlFromCatalogUrl(url));
+    UbuntuCloudImageMirrorOptions options;
+    options.max_concurrent_downloads = 3;
+    options.max_connections_per_host = 1;
+
+    const fs::path jammy_path = dir / "server/jammy/20240301/disk1.img";
+    const fs::path noble_path = dir / "server/noble/20240501/disk1.img";
+    const fs::path oracular_path = dir / "server/oracular/20241010/disk1.img";
+
+    // First run downloads the newest serials, rejects the bad body and reports the release without image
+    {
+        auto res = mirror.Mirror(dir.string(), options);
+        CHECK(std::holds_alternative<UbuntuCloudImageMirrorReport>(res));
+        auto report = std::get<UbuntuCloudImageMirrorReport>(res);
+        CHECK(report.planned == 5);
+        CHECK(report.skipped == 0);
+        CHECK(report.downloaded == 2);
+        CHECK(report.failed == 3);
+        CHECK(report.bytes_downloaded == jammy_body.size() + noble_body.size());
+        CHECK(HasFailure(report, "SHA256 mismatch"));
+        CHECK(HasFailure(report, "questing/20251010/disk1.img : size mismatch"));
+        CHECK(HasFailure(report, "plucky : no disk1.img"));
+        CHECK(ReadFile(jammy_path) == jammy_body);
+        CHECK(ReadFile(noble_path) == noble_body);
+        CHECK(!fs::exists(oracular_path));
+        CHECK(!fs::exists(oracular_path.string() + ".part"));
+        CHECK(!fs::exists(dir / "server/jammy/old"));
+        CHECK(hits["jammy"] == 1);
+        CHECK(hits["noble"] == 1);
+    }
+
+    // Second run finds both images present and verified
+    {
+        auto res = mirror.Mirror(dir.string(), options);
+        CHECK(std::holds_alternative<UbuntuCloudImageMirrorReport>(res));
+        auto report = std::get<UbuntuCloudImageMirrorReport>(res);
+        CHECK(report.skipped == 2);
+        CHECK(report.downloaded == 0);
+        CHECK(hits["jammy"] == 1);
+        CHECK(hits["noble"] == 1);
+    }
+
+    // A corrupted local file of the right size is downloaded again
+    {
+        std::fstream file(jammy_path, std::ios::binary | std::ios::in | std::ios::out);
+        file.seekp(1000);
+        file.put('z');
+        file.close();
+
+        auto res = mirror.Mirror(dir.string(), options);
+        CHECK(std::holds_alternative<UbuntuCloudImageMirrorReport>(res));
+        auto report = std::get<UbuntuCloudImageMirrorReport>(res);
+        CHECK(report.skipped == 1);
+        CHECK(report.downloaded == 1);
+        CHECK(hits["jammy"] == 2);
+        CHECK(ReadFile(jammy_path) == jammy_body);
+    }
+
+    // Concurrency limits of 0 are refused
+    {
+        UbuntuCloudImageMirrorOptions invalid;
+        invalid.max_concurrent_downloads = 0;
+        auto res = mirror.Mirror(dir.string(), invalid);
+        CHECK(std::holds_alternative<MirrorError>(res) && std::get<MirrorError>(res) == MirrorError::InvalidOptions);
+    }
+
+    // The scheduler stays within both connection limits, and does use them
+    const std::string scheduler_url = "http://127.0.0.1:" + port_str + "/sched/streams/v1/index.json";
+    UbuntuCloudImageFetcher scheduler_fetcher;
+    CHECK(scheduler_fetcher.FetchLatestImageInfo(scheduler_url) == FetchError::NoError);
+    UbuntuCloudImageMirror scheduler_mirror(scheduler_fetcher, UbuntuCloudImageMirror::BaseUrlFromCatalogUrl(scheduler_url));
+    {
+        fs::remove_all(dir);
+        UbuntuCloudImageMirrorOptions limits;
+        limits.max_concurrent_downloads = 3;
+        limits.max_connections_per_host = 2;
+        monitor.Reset();
+
+        auto res = scheduler_mirror.Mirror(dir.string(), limits);
+        CHECK(std::holds_alternative<UbuntuCloudImageMirrorReport>(res));
+        auto report = std::get<UbuntuCloudImageMirrorReport>(res);
+        CHECK(report.downloaded == 6);
+        CHECK(report.bytes_downloaded == scheduler_total_size);
+        CHECK(monitor.peak["127.0.0.1"] <= 2);
+        CHECK(monitor.peak["localhost"] <= 2);
+        CHECK(monitor.peak_total <= 3);
+        CHECK(monitor.peak_total >= 2);
+    }
+
+    // A single download at a time requests the images largest first
+    {
+        fs::remove_all(dir);
+        UbuntuCloudImageMirrorOptions sequential;
+        sequential.max_concurrent_downloads = 1;
+        sequential.max_connections_per_host = 1;
+        monitor.Reset();
+
+        auto res = scheduler_mirror.Mirror(dir.string(), sequential);
+        CHECK(std::holds_alternative<UbuntuCloudImageMirrorReport>(res));
+        CHECK(std::get<UbuntuCloudImageMirrorReport>(res).downloaded == 6);
+        CHECK(monitor.peak_total == 1);
+        std::vector<std::string> largest_first;
+        for (const auto& image : scheduler_images) largest_first.push_back(image.codename);
+        CHECK(monitor.order == largest_first);
+    }
+
+    // The rate limit holds over all the parallel downloads
+    {
+        fs::remove_all(dir);
+        UbuntuCloudImageMirrorOptions limited;
+        limited.max_concurrent_downloads = 3;
+        limited.max_connections_per_host = 2;
+        limited.max_bytes_per_second = 1000000;
+
+        auto start = std::chrono::steady_clock::now();
+        auto res = scheduler_mirror.Mirror(dir.string(), limited);
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        CHECK(std::holds_alternative<UbuntuCloudImageMirrorReport>(res));
+        CHECK(std::get<UbuntuCloudImageMirrorReport>(res).downloaded == 6);
+        CHECK(elapsed >= static_cast<double>(scheduler_total_size) / limited.max_bytes_per_second);
+    }
+
+    svr.stop();
+    server_thread.join();
+    fs::remove_all(dir);
+
+    if (failures > 0) {
+        std::cerr << failures << " check(s) failed\n";
+        return 1;
+    }
+    std::cout << "mirror_test passed\n";
+    return 0;
+}